@@ -28,8 +28,30 @@
 		  ("CNE" (23))
 		  ("CLE" (24))
 		  ("CLT" (25))
-		  ("TAP" (18 BYTE))
+		  ("TAP" (49 BYTE))
 		  ("TSEL" (26 INT INT))
+		  ("VMAKE" (27 BYTE))
+		  ("VREF" (28))
+		  ("VSET" (29))
+		  ("VLEN" (30))
+		  ("VFILL" (31))
+		  ("VCOPY" (32))
+		  ("READ" (33))
+		  ("WRITE" (34))
+		  ("EOFP" (35))
+		  ("HMAKE" (36))
+		  ("HGET" (37))
+		  ("HPUT" (38))
+		  ("HDEL" (39))
+		  ("HSIZE" (40))
+		  ("LDG" (41 INT))
+		  ("SPAWN" (42 BYTE))
+		  ("SEND" (43))
+		  ("RECV" (44))
+		  ("SELF" (45))
+		  ("CALLHOST" (46 BYTE BYTE))
+		  ("MEMO" (47))
+		  ("MRTN" (48))
 		  ))
 
 (define (comment? l)
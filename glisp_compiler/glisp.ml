@@ -3,6 +3,7 @@ and
 def = 
     | Defun of string * (string list) * (statement list)
     | Defun_Tail of string * (string list) * (statement list)
+    | Defun_Memo of string * (string list) * (statement list)
     | Defconst of string * int
 and
 statement = 
@@ -31,6 +32,26 @@ statement =
     | Quote of term list
     | Break
     | Lambda of (string list) * (statement list)
+    | Make_Vector of statement * statement
+    | Make_Int_Vector of statement * statement
+    | Vector_Ref of statement * statement
+    | Vector_Set of statement * statement * statement
+    | Vector_Length of statement
+    | Vector_Fill of statement * statement
+    | Vector_Copy of statement * statement * statement * statement * statement
+    | Read
+    | Write of statement
+    | Eof_p
+    | Make_Hash of statement
+    | Hash_Get of statement * statement * statement
+    | Hash_Put of statement * statement * statement
+    | Hash_Delete of statement * statement
+    | Hash_Size of statement
+    | Spawn of string * (statement list)
+    | Send of statement * statement
+    | Receive
+    | Self
+    | Host_Call of int * (statement list)
 and
 let_env = string * statement
 and
@@ -44,7 +65,7 @@ type symbol_table_entry =
 
 type state = { current_function_code : string list; environment_stack : string list list; function_list : (string*(string list)) list;
  next_temp_number : int; symbol_table : (string * symbol_table_entry) list; pc : int; is_tail_recursive : bool;
-    top_level_env : string list}
+    top_level_env : string list; top_level_functions : string list}
 
 let index_of l v =
     let rec index_of_iter l v n =
@@ -126,7 +147,12 @@ and
     generate_symbol_function state c =
     match find_symbol_in_env state c with
     | Some (frame, idx) -> add_code_line state ("LD "^(string_of_int frame)^" "^(string_of_int idx))
-    | None -> add_code_line state ("LDF %"^c^"%")
+    | None ->
+        (* Top-level functions don't need the current environment, so they share one closure *)
+        if List.mem c state.top_level_functions then
+            add_code_line state ("LDG %"^c^"%")
+        else
+            add_code_line state ("LDF %"^c^"%")
 and
     generate_single_arg_call state arg operator =
         let state = generate_statement state arg in
@@ -136,6 +162,10 @@ and
         let state = generate_statement state arg1 in
         let state = generate_statement state arg2 in
         add_code_line state operator
+and
+    generate_n_arg_call state args operator =
+        let state = List.fold_left generate_statement state args in
+        add_code_line state operator
 and
     generate_statement state stmt =
         match stmt with
@@ -166,6 +196,31 @@ and
         | Quote (statements) -> generate_quote state statements
         | Break -> add_code_line state "BRK"
         | Lambda (params, statements) -> generate_lambda state params statements
+        | Make_Vector (len,fill) -> generate_two_arg_call state len fill "VMAKE 1"
+        | Make_Int_Vector (len,fill) -> generate_two_arg_call state len fill "VMAKE 0"
+        | Vector_Ref (vec,idx) -> generate_two_arg_call state vec idx "VREF"
+        | Vector_Set (vec,idx,v) -> generate_n_arg_call state [vec; idx; v] "VSET"
+        | Vector_Length vec -> generate_single_arg_call state vec "VLEN"
+        | Vector_Fill (vec,v) -> generate_two_arg_call state vec v "VFILL"
+        | Vector_Copy (dst,at,src,first,last) -> generate_n_arg_call state [dst; at; src; first; last] "VCOPY"
+        | Read -> add_code_line state "READ"
+        | Write arg -> generate_single_arg_call state arg "WRITE"
+        | Eof_p -> add_code_line state "EOFP"
+        | Make_Hash size -> generate_single_arg_call state size "HMAKE"
+        | Hash_Get (h,k,default) -> generate_n_arg_call state [h; k; default] "HGET"
+        | Hash_Put (h,k,v) -> generate_n_arg_call state [h; k; v] "HPUT"
+        | Hash_Delete (h,k) -> generate_two_arg_call state h k "HDEL"
+        | Hash_Size h -> generate_single_arg_call state h "HSIZE"
+        | Spawn (fn,statements) -> generate_function_call state fn statements "SPAWN"
+        | Send (pid,msg) -> generate_two_arg_call state pid msg "SEND"
+        | Receive -> add_code_line state "RECV"
+        | Self -> add_code_line state "SELF"
+        | Host_Call (id,statements) ->
+            (* CALLHOST carries the id in a single byte *)
+            if (id < 0) || (id > 255) then
+                raise (Failure ("Host function id "^(string_of_int id)^" out of range\n"))
+            else
+            generate_n_arg_call state statements ("CALLHOST "^(string_of_int id)^" "^(string_of_int (List.length statements)))
 and
     generate_if state test true_statement false_statement =
         let (true_symbol, state) = allocate_temp_symbol state in
@@ -183,6 +238,10 @@ and
         add_code_line state (call_instr^" "^(string_of_int (List.length statements)))
 and
     generate_tail_function_call state fn statements =
+        (* TAP keeps the caller's return frame on D, which only holds in a
+           defun-tail where every if is a TSEL; anywhere else SEL frames sit
+           on top of it, so recur is an ordinary call there *)
+        if not state.is_tail_recursive then generate_function_call state fn statements "RAP" else
         let state = List.fold_left generate_statement state statements in
 (*        let state = add_code_line state ("DUM "^(string_of_int (List.length statements))) in *)
         let state = generate_symbol_function state fn in
@@ -212,6 +271,20 @@ and
         let state = { state with function_list = (fn, state.current_function_code)::state.function_list} in
         let state = add_symbol state fn (FunctionSymbol (-1)) in
         { state with current_function_code = curr_code; environment_stack=List.tl state.environment_stack }
+and
+    generate_memo_function state fn env_stack env statements =
+        let curr_code = state.current_function_code in
+        (* MRTN needs the key AP/RAP left under this function's own return
+           frame, so a TAP must never replace that frame: recur in here is
+           an ordinary call *)
+        let state = { state with current_function_code=[]; environment_stack=env::env_stack; is_tail_recursive=false } in
+        let state = add_code_line state (";FN="^fn) in
+        let state = add_code_line state "MEMO" in
+        let state = generate_statements state statements in
+        let state = add_code_line state "MRTN" in
+        let state = { state with function_list = (fn, state.current_function_code)::state.function_list} in
+        let state = add_symbol state fn (FunctionSymbol (-1)) in
+        { state with current_function_code = curr_code; environment_stack=List.tl state.environment_stack }
 and
     generate_tail_function state fn env_stack env statements =
         let curr_code = state.current_function_code in
@@ -266,9 +339,11 @@ and
         | Defconst (name,value) -> add_symbol state name (ConstantSymbol value)
         | Defun (name,env,statements) -> generate_function { state with current_function_code=[]; is_tail_recursive=false } name [state.top_level_env] env statements "RTN"
         | Defun_Tail (name,env,statements) -> generate_tail_function { state with current_function_code=[]; is_tail_recursive=true } name [state.top_level_env] env statements
+        | Defun_Memo (name,env,statements) -> generate_memo_function { state with current_function_code=[]; is_tail_recursive=false } name [state.top_level_env] env statements
 
 let new_state = { current_function_code=[] ; environment_stack=[]; function_list=[];
-    next_temp_number=0; symbol_table=[] ; pc=0; is_tail_recursive=false; top_level_env=[]}
+    next_temp_number=0; symbol_table=[] ; pc=0; is_tail_recursive=false; top_level_env=[];
+    top_level_functions=[]}
 
 let print_function (fn,code) = 
     print_string("function "); print_string fn; print_string(":"); print_newline();
@@ -289,24 +364,29 @@ let update_symbol_values state instructions =
     let is_comment x = (((String.length x) > 0) && (x.[0] = ';')) in
     let is_LDC x = (((String.length x) > 4) && ((String.sub x 0 3) = "LDC")) in
     let is_LDF x = (((String.length x) > 4) && ((String.sub x 0 3) = "LDF")) in
+    let is_LDG x = (((String.length x) > 4) && ((String.sub x 0 3) = "LDG")) in
     let is_LD x = (((String.length x) > 3) && ((String.sub x 0 3) = "LD ")) in
     let is_AP x = (((String.length x) > 3) && ((String.sub x 0 3) = "AP ")) in
     let is_RAP x = (((String.length x) > 4) && ((String.sub x 0 3) = "RAP")) in
+    let is_TAP x = (((String.length x) > 4) && ((String.sub x 0 3) = "TAP")) in
     let is_DUM x = (((String.length x) > 4) && ((String.sub x 0 3) = "DUM")) in
     let is_SEL x = (((String.length x) > 4) && ((String.sub x 0 3) = "SEL")) in
     let is_TSEL x = (((String.length x) > 5) && ((String.sub x 0 4) = "TSEL")) in
+    let is_VMAKE x = (((String.length x) > 6) && ((String.sub x 0 5) = "VMAKE")) in
+    let is_SPAWN x = (((String.length x) > 6) && ((String.sub x 0 5) = "SPAWN")) in
+    let is_CALLHOST x = (((String.length x) > 9) && ((String.sub x 0 8) = "CALLHOST")) in
     let check_for_update state x =
         if is_fn_comment x then
             update_symbol state x
         else if is_comment x then
             state
-        else if is_LDC x || is_LDF x then
+        else if is_LDC x || is_LDF x || is_LDG x then
             { state with pc = state.pc + 5 }
         else if is_SEL x || is_TSEL x then
             { state with pc = state.pc + 9 }
-        else if is_AP x || is_RAP x || is_DUM x then
+        else if is_AP x || is_RAP x || is_TAP x || is_DUM x || is_VMAKE x || is_SPAWN x then
             { state with pc = state.pc + 2 }
-        else if is_LD x then
+        else if is_LD x || is_CALLHOST x then
             { state with pc = state.pc + 3 }
         else
             { state with pc = state.pc + 1 } in
@@ -316,7 +396,7 @@ let replace_symbol_load state load =
     try
         let sym = List.assoc load (state.symbol_table) in
         match sym with
-        | FunctionSymbol i -> "LDF "^(string_of_int i)
+        | FunctionSymbol i -> "LDG "^(string_of_int i)
         | ConstantSymbol i -> "LDC "^(string_of_int i)
     with exn ->
         print_string ("Symbol "^load^" not found\n"); flush stdout;
@@ -348,8 +428,16 @@ let rec replace_symbol_references state instr =
     else
         instr
 
+let defun_name def =
+    match def with
+    | Defun (name,_,_) -> [name]
+    | Defun_Tail (name,_,_) -> [name]
+    | Defun_Memo (name,_,_) -> [name]
+    | Defconst _ -> []
+
 let generate_program tree outbuf =
-    let state = List.fold_left generate_def new_state tree in
+    let state = { new_state with top_level_functions = List.concat (List.map defun_name tree) } in
+    let state = List.fold_left generate_def state tree in
     let state = main_comes_first state in
     let instructions = List.concat (List.map snd state.function_list) in
     let state = update_symbol_values state instructions in
@@ -0,0 +1,42 @@
+#ifndef LIBSECD_H
+#define LIBSECD_H
+
+/* Embedding API for the SECD machine.
+ *
+ * Load a program once with secd_load, then run any of its functions with
+ * secd_call, giving the code address of the function (the ;FN= position
+ * in the assembly, 0 for main). Values made with secd_int and secd_cons,
+ * the result of secd_call and anything reachable from them stay valid
+ * until the next secd_call; inside a host function, the values it makes
+ * stay valid until it returns. Protect any value that must live longer
+ * with secd_protect. Calls must not be nested. */
+
+#define SECD_OK 0
+#define SECD_ERROR -1
+
+/* A value on the VM heap, only ever handled through the functions below */
+typedef struct _CELL SECD_CELL;
+
+/* A native function callable from programs through CALLHOST */
+typedef SECD_CELL *(*SECD_HOST_FUNCTION)(SECD_CELL **args, int nargs);
+
+int secd_load(const unsigned char *bytecode, int len);
+int secd_call(int entry, SECD_CELL **args, int nargs, SECD_CELL **result);
+const char *secd_error();
+
+int secd_register(int id, SECD_HOST_FUNCTION fn);
+
+/* secd_int and secd_cons return NULL, with secd_error set, when the heap
+ * is full */
+SECD_CELL *secd_int(int i);
+SECD_CELL *secd_cons(SECD_CELL *car, SECD_CELL *cdr);
+int secd_is_int(SECD_CELL *cell);
+int secd_is_cons(SECD_CELL *cell);
+int secd_int_value(SECD_CELL *cell);
+SECD_CELL *secd_car(SECD_CELL *cell);
+SECD_CELL *secd_cdr(SECD_CELL *cell);
+
+int secd_protect(SECD_CELL **cell);
+void secd_unprotect();
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <limits.h>
 
 #include "secd.h"
 
@@ -31,24 +33,90 @@
 #define INSTR_CLE  24
 #define INSTR_CLT  25
 #define INSTR_TSEL 26
-
-char *instrs[27] = { "NIL", "LDC", "LD", "ATOM", "CAR", "CDR", "CONS",
+#define INSTR_VMAKE 27
+#define INSTR_VREF 28
+#define INSTR_VSET 29
+#define INSTR_VLEN 30
+#define INSTR_VFILL 31
+#define INSTR_VCOPY 32
+#define INSTR_READ 33
+#define INSTR_WRITE 34
+#define INSTR_EOFP 35
+#define INSTR_HMAKE 36
+#define INSTR_HGET 37
+#define INSTR_HPUT 38
+#define INSTR_HDEL 39
+#define INSTR_HSIZE 40
+#define INSTR_LDG 41
+#define INSTR_SPAWN 42
+#define INSTR_SEND 43
+#define INSTR_RECV 44
+#define INSTR_SELF 45
+#define INSTR_CALLHOST 46
+#define INSTR_MEMO 47
+#define INSTR_MRTN 48
+#define INSTR_TAP 49
+
+char *instrs[50] = { "NIL", "LDC", "LD", "ATOM", "CAR", "CDR", "CONS",
     "ADD", "SUB", "MUL", "DIV", "MOD", "SEL", "JOIN", "LDF", "AP", "RTN",
-    "DUM", "RAP", "STOP", "CGE", "CGT", "CEQ", "CNE", "CLE", "CLT", "TSEL" };
+    "DUM", "RAP", "STOP", "CGE", "CGT", "CEQ", "CNE", "CLE", "CLT", "TSEL",
+    "VMAKE", "VREF", "VSET", "VLEN", "VFILL", "VCOPY", "READ", "WRITE",
+    "EOFP", "HMAKE", "HGET", "HPUT", "HDEL", "HSIZE", "LDG", "SPAWN", "SEND",
+    "RECV", "SELF", "CALLHOST", "MEMO", "MRTN", "TAP" };
 
 CELL cell_pool[MAX_CELLS];
+uint32_t cell_data[MAX_CELLS];
+uint32_t mark_bits[MARK_WORDS];
+
+int vector_pool[MAX_VECTOR_SLOTS];
+int vector_top = 0;
 
-CELL *free_list = NULL;
+int sweep_word = 0;
+int free_count = 0;
 
 CELL *S = NULL;
 CELL *E = NULL;
 CELL *C = NULL;
 CELL *D = NULL;
 
+PROCESS processes[MAX_PROCESSES];
+int current_process = 0;
+
+/* Frames on the running process's D, so a trace shows how deep it is
+ * without walking the list */
+int dump_depth = 0;
+
+/* Closures over the top-level environment, shared by every LDG of the
+ * same function. Open addressed on the code address, 0 marks a free slot. */
+unsigned short global_closures[MAX_GLOBAL_CLOSURES];
+
+HOST_FUNCTION host_functions[MAX_HOST_FUNCTIONS];
+
+/* Values made by host code, kept alive until the VM takes them over */
+CELL *host_values = NULL;
+
+MEMO_ENTRY memo_table[MEMO_SIZE];
+uint32_t memo_clock = 0;
+
+CELL **roots[MAX_ROOTS];
+int root_count = 0;
+
 unsigned char code[MAX_CODE_SIZE];
 
+/* Ring buffer of the last TRACE_SIZE instructions, filled while
+ * trace_enabled is set */
+TRACE_RECORD trace_ring[TRACE_SIZE];
+uint32_t trace_next = 0;
+uint32_t alloc_count = 0;
+volatile int trace_enabled = 0;
+volatile int trace_dump_requested = 0;
+
 extern void print_cell(CELL *cell);
 extern void panic(char *message);
+extern int input_char();
+extern void unread_char(int ch);
+extern void write_value(CELL *cell);
+extern void write_trace_record(TRACE_RECORD *record);
 
 int compute_offset(CELL *cell) {
     if (cell == NULL) {
@@ -65,43 +133,78 @@ CELL *cell_for_offset(int offset) {
     return &cell_pool[offset];
 }
 
-void initialize_pool() {
-    for (int i=1; i < MAX_CELLS-1; i++) {
-        cell_pool[i].data = compute_offset(&cell_pool[i+1]);
+#define IS_MARKED(i) (mark_bits[(i) >> 5] & (1u << ((i) & 31)))
+#define SET_MARK(i) (mark_bits[(i) >> 5] |= (1u << ((i) & 31)))
+
+/* Cell 0 stands for nil and the bits past the end of the pool don't name
+ * a cell, so they always read as in use. */
+void clear_marks() {
+    memset(mark_bits, 0, sizeof(mark_bits));
+    SET_MARK(0);
+    for (int i=MAX_CELLS; i < MARK_WORDS * 32; i++) {
+        SET_MARK(i);
     }
-    cell_pool[MAX_CELLS-1].data = 0;
-    free_list = &cell_pool[1];
 }
 
-void free_cell(CELL *cell) {
-    switch (cell->cell_type) {
-        case TYPE_INT:
-        case TYPE_NIL:
-            break;
-        case TYPE_CONS:
-            if (cell->data >> 16 > 0) {
-                free_cell(&cell_pool[cell->data >> 16]);
-            }
-            if (cell->data & 0xffff > 0) {
-                free_cell(&cell_pool[cell->data & 0xffff]);
-            }
-            break;
+int count_bits(uint32_t w) {
+    w = w - ((w >> 1) & 0x55555555);
+    w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+    w = (w + (w >> 4)) & 0x0f0f0f0f;
+    return (w * 0x01010101) >> 24;
+}
+
+int lowest_bit(uint32_t w) {
+    int n = 0;
+
+    while (!(w & 1)) {
+        w >>= 1;
+        n++;
     }
-    cell->data = (long) free_list;
-    free_list = cell;
+    return n;
+}
+
+void initialize_pool() {
+    clear_marks();
+    sweep_word = 0;
+    free_count = MAX_CELLS - 1;
+    vector_top = 0;
+    memset(global_closures, 0, sizeof(global_closures));
+    memset(processes, 0, sizeof(processes));
+    current_process = 0;
+    memset(memo_table, 0, sizeof(memo_table));
+    host_values = NULL;
 }
 
 void mark_cells(CELL *cell) {
     if (cell == NULL) {
         return;
     }
-    if (cell->tag == 1) {
+    if (IS_MARKED(compute_offset(cell))) {
         return;
     }
-    cell->tag = 1;
+    SET_MARK(compute_offset(cell));
     if (cell->cell_type == TYPE_CONS) {
-        mark_cells(&cell_pool[cell->data >> 16]);
-        mark_cells(&cell_pool[cell->data & 0xffff]);
+        mark_cells(cell_for_offset(CAR_OFFSET(cell)));
+        mark_cells(cell_for_offset(CDR_OFFSET(cell)));
+    } else if ((cell->cell_type == TYPE_VECTOR) &&
+               (VECTOR_KIND(cell) == VECTOR_VALUE)) {
+        int *slots = VECTOR_SLOTS(cell);
+        int len = VECTOR_LENGTH(cell);
+
+        for (int i=0; i < len; i++) {
+            mark_cells(cell_for_offset(slots[i]));
+        }
+    } else if (cell->cell_type == TYPE_CLOSURE) {
+        mark_cells(CLOSURE_ENV(cell));
+    } else if (cell->cell_type == TYPE_HASH) {
+        int *entries = HASH_ENTRIES(cell);
+        int cap = HASH_CAPACITY(cell);
+
+        for (int i=0; i < cap; i++) {
+            if (entries[i*3] == HASH_FULL) {
+                mark_cells(cell_for_offset(entries[i*3+2]));
+            }
+        }
     }
 }
 
@@ -110,48 +213,123 @@ void mark() {
     mark_cells(E);
     mark_cells(C);
     mark_cells(D);
-    mark_cells(free_list);
+    for (int i=0; i < MAX_PROCESSES; i++) {
+        if (i != current_process) {
+            mark_cells(processes[i].S);
+            mark_cells(processes[i].E);
+            mark_cells(processes[i].C);
+            mark_cells(processes[i].D);
+        }
+        mark_cells(processes[i].mailbox);
+    }
+    for (int i=0; i < MEMO_SIZE; i++) {
+        if (memo_table[i].used) {
+            mark_cells(cell_for_offset(memo_table[i].result));
+        }
+    }
+    for (int i=0; i < MAX_GLOBAL_CLOSURES; i++) {
+        mark_cells(cell_for_offset(global_closures[i]));
+    }
+    mark_cells(host_values);
+    for (int i=0; i < root_count; i++) {
+        mark_cells(*roots[i]);
+    }
 }
 
-void sweep() {
-    for (int i=1; i < MAX_CELLS; i++) {
-        if (!cell_pool[i].tag) {
-            cell_pool[i].data = compute_offset(free_list);
-            free_list = &cell_pool[i];
-#ifdef DEBUG
-            printf("Freed cell %d\n", i);
-#endif
-        } else {
-            cell_pool[i].tag = 0;
+/* Slides the blocks of live vectors and hash tables down to the bottom of
+ * vector_pool. Must run while the mark bits are still set. */
+void compact_vectors() {
+    int from, to, owner, len;
+    CELL *cell;
+
+    from = 0;
+    to = 0;
+    while (from < vector_top) {
+        owner = vector_pool[from];
+        len = vector_pool[from+1];
+        cell = cell_for_offset(owner);
+
+        if ((cell != NULL) && IS_MARKED(owner) && HAS_BLOCK(cell) &&
+            (VECTOR_START(cell) == from)) {
+            if (to != from) {
+                memmove(&vector_pool[to], &vector_pool[from],
+                        (len + 2) * sizeof(int));
+                CELL_DATA(cell) = (CELL_DATA(cell) & ~0xffffu) | to;
+            }
+            to += len + 2;
         }
+        from += len + 2;
     }
+    vector_top = to;
 }
 
+/* Marks everything reachable and leaves the unmarked cells to be picked
+ * up lazily by alloc_cell. */
 void collect_garbage() {
+    clear_marks();
     mark();
-    sweep();
+    compact_vectors();
+    free_count = 0;
+    for (int k=0; k < MARK_WORDS; k++) {
+        free_count += 32 - count_bits(mark_bits[k]);
+    }
+    sweep_word = 0;
 #ifdef DEBUG
-    printf("\nCollected Garbage\n");
+    printf("\nCollected Garbage, %d cells free\n", free_count);
     fflush(stdout);
 #endif
 }
 
-CELL *alloc_cell() {
-    CELL *new_cell;
+/* Keeps a cell held only in a C local alive across allocations. */
+void push_root(CELL **cell) {
+    if (root_count >= MAX_ROOTS) {
+        panic("Too many GC roots");
+    }
+    roots[root_count++] = cell;
+}
 
-    if (free_list == NULL) {
-        collect_garbage();
+void pop_root() {
+    root_count--;
+}
+
+int register_host_function(int id, HOST_FUNCTION fn) {
+    if ((id < 0) || (id >= MAX_HOST_FUNCTIONS)) {
+        return -1;
     }
+    host_functions[id] = fn;
+    return 0;
+}
 
-    new_cell = free_list;
+/* Sweeps lazily, scanning the mark bits a word at a time for a cell the
+ * last collection left unmarked. Allocated cells are marked straight away
+ * so the scan never hands them out twice. */
+int find_free_cell() {
+    uint32_t free_bits;
 
-    if (new_cell != NULL) {
-        free_list = &cell_pool[new_cell->data];
-    } else {
+    while (sweep_word < MARK_WORDS) {
+        free_bits = ~mark_bits[sweep_word];
+        if (free_bits != 0) {
+            return sweep_word * 32 + lowest_bit(free_bits);
+        }
+        sweep_word++;
+    }
+    return 0;
+}
+
+CELL *alloc_cell() {
+    int i;
+
+    /* Never collects: a caller may be holding new cells only in C locals.
+     * Collections happen at the safe points that call reserve_cells. */
+    i = find_free_cell();
+    if (i == 0) {
         panic("out of memory");
     }
+    SET_MARK(i);
+    free_count--;
+    alloc_count++;
 
-    return new_cell;
+    return &cell_pool[i];
 }
 
 CELL *make_int_cell(int i) {
@@ -159,7 +337,7 @@ CELL *make_int_cell(int i) {
 
     new_cell = alloc_cell();
     new_cell->cell_type = TYPE_INT;
-    new_cell->data = i;
+    CELL_DATA(new_cell) = i;
 
     return new_cell;
 }
@@ -169,11 +347,242 @@ CELL *make_nil_cell() {
 
     new_cell = alloc_cell();
     new_cell->cell_type = TYPE_NIL;
-    new_cell->data = 0;
+    CELL_DATA(new_cell) = 0;
+
+    return new_cell;
+}
+
+/* Makes sure n cells can be allocated without collecting. Only call this
+ * where everything live is reachable from the registers or the roots. */
+void reserve_cells(int n) {
+    if (free_count < n) {
+        collect_garbage();
+        if (free_count < n) {
+            panic("out of memory");
+        }
+    }
+}
+
+/* Makes sure a block of len slots can be taken from vector_pool without
+ * collecting. Collecting only ever makes more room in vector_pool, so the
+ * space stays free across any cell allocations made before new_block. */
+void reserve_block(int len) {
+    if (len + 2 > MAX_VECTOR_SLOTS - vector_top) {
+        collect_garbage();
+        if (len + 2 > MAX_VECTOR_SLOTS - vector_top) {
+            panic("out of vector memory");
+        }
+    }
+}
+
+int new_block(CELL *owner, int len) {
+    int start;
+
+    start = vector_top;
+    vector_top += len + 2;
+    vector_pool[start] = compute_offset(owner);
+    vector_pool[start+1] = len;
+
+    return start;
+}
+
+CELL *make_vector_cell(int kind, int len, CELL *fill) {
+    CELL *new_cell;
+    int start, fill_value, *slots;
+
+    if (len < 0) {
+        panic("Negative vector length");
+    }
+    if (len > MAX_VECTOR_SLOTS - 2) {
+        panic("out of vector memory");
+    }
+    reserve_block(len);
+
+    if (kind == VECTOR_INT) {
+        if ((fill == NULL) || (fill->cell_type != TYPE_INT)) {
+            panic("Expected int fill for int vector");
+        }
+        fill_value = (int) CELL_DATA(fill);
+    } else {
+        fill_value = compute_offset(fill);
+    }
+
+    new_cell = alloc_cell();
+    new_cell->cell_type = TYPE_VECTOR;
+
+    start = new_block(new_cell, len);
+    CELL_DATA(new_cell) = (kind << 16) | start;
+
+    slots = VECTOR_SLOTS(new_cell);
+    for (int i=0; i < len; i++) {
+        slots[i] = fill_value;
+    }
+
+    return new_cell;
+}
+
+int hash_index(int key, int cap) {
+    unsigned int h;
+
+    h = (unsigned int) key * 2654435769u;
+    h ^= h >> 16;
+    return h & (cap - 1);
+}
+
+/* Stores key/value in the first free entry of its probe sequence and
+ * returns 1 if that entry had never been used before. */
+int hash_insert_entry(int *entries, int cap, int key, int value) {
+    int i, *entry;
+
+    i = hash_index(key, cap);
+    while (entries[i*3] == HASH_FULL) {
+        i = (i + 1) & (cap - 1);
+    }
+    entry = &entries[i*3];
+    entry[1] = key;
+    entry[2] = value;
+    if (entry[0] == HASH_EMPTY) {
+        entry[0] = HASH_FULL;
+        return 1;
+    }
+    entry[0] = HASH_FULL;
+    return 0;
+}
+
+void init_hash_block(CELL *hash, int cap) {
+    int start;
+
+    start = new_block(hash, HASH_BLOCK_LENGTH(cap));
+    CELL_DATA(hash) = start;
+    HASH_COUNT(hash) = 0;
+    HASH_USED(hash) = 0;
+    memset(HASH_ENTRIES(hash), 0, cap * 3 * sizeof(int));
+}
+
+CELL *make_hash_cell(int cap) {
+    CELL *new_cell;
+    int size;
+
+    if (cap > HASH_MAX_CAPACITY) {
+        panic("out of vector memory");
+    }
+    size = HASH_MIN_CAPACITY;
+    while (size < cap) {
+        size <<= 1;
+    }
+    reserve_block(HASH_BLOCK_LENGTH(size));
+
+    new_cell = alloc_cell();
+    new_cell->cell_type = TYPE_HASH;
+    init_hash_block(new_cell, size);
+
+    return new_cell;
+}
+
+int *hash_lookup(CELL *hash, int key) {
+    int cap, i, *entries;
+
+    cap = HASH_CAPACITY(hash);
+    entries = HASH_ENTRIES(hash);
+    i = hash_index(key, cap);
+    for (int n=0; n < cap; n++) {
+        if (entries[i*3] == HASH_EMPTY) {
+            return NULL;
+        }
+        if ((entries[i*3] == HASH_FULL) && (entries[i*3+1] == key)) {
+            return &entries[i*3];
+        }
+        i = (i + 1) & (cap - 1);
+    }
+    return NULL;
+}
+
+/* Moves the entries into a fresh block, doubling it if it is at least half
+ * full, which also drops any deleted entries. The hash cell must be
+ * reachable from the registers, since this may collect garbage. */
+void hash_grow(CELL *hash) {
+    int cap, new_cap, old_start, *old_entries, *entries;
+
+    cap = HASH_CAPACITY(hash);
+    new_cap = (HASH_COUNT(hash) * 2 >= cap) ? cap * 2 : cap;
+    reserve_block(HASH_BLOCK_LENGTH(new_cap));
+
+    old_start = VECTOR_START(hash);
+    init_hash_block(hash, new_cap);
+    HASH_COUNT(hash) = vector_pool[old_start+2];
+    HASH_USED(hash) = HASH_COUNT(hash);
+
+    old_entries = &vector_pool[old_start+4];
+    entries = HASH_ENTRIES(hash);
+    for (int i=0; i < cap; i++) {
+        if (old_entries[i*3] == HASH_FULL) {
+            hash_insert_entry(entries, new_cap, old_entries[i*3+1],
+                              old_entries[i*3+2]);
+        }
+    }
+}
+
+void hash_put(CELL *hash, int key, CELL *value) {
+    int *entry;
+
+    entry = hash_lookup(hash, key);
+    if (entry != NULL) {
+        entry[2] = compute_offset(value);
+        return;
+    }
+
+    if ((HASH_USED(hash) + 1) * 4 > HASH_CAPACITY(hash) * 3) {
+        hash_grow(hash);
+    }
+    HASH_USED(hash) += hash_insert_entry(HASH_ENTRIES(hash),
+        HASH_CAPACITY(hash), key, compute_offset(value));
+    HASH_COUNT(hash)++;
+}
+
+void hash_delete(CELL *hash, int key) {
+    int *entry;
+
+    entry = hash_lookup(hash, key);
+    if (entry != NULL) {
+        entry[0] = HASH_DELETED;
+        entry[2] = 0;
+        HASH_COUNT(hash)--;
+    }
+}
+
+CELL *make_closure_cell(int addr, CELL *env) {
+    CELL *new_cell;
+
+    new_cell = alloc_cell();
+    new_cell->cell_type = TYPE_CLOSURE;
+    CELL_DATA(new_cell) = (addr << 16) | compute_offset(env);
 
     return new_cell;
 }
 
+/* Top-level functions never reach past their own frames, so a single
+ * closure with an empty environment serves every reference to one. */
+CELL *global_closure(int addr) {
+    CELL *closure;
+    int i;
+
+    i = addr % MAX_GLOBAL_CLOSURES;
+    for (int n=0; n < MAX_GLOBAL_CLOSURES; n++) {
+        closure = cell_for_offset(global_closures[i]);
+        if (closure == NULL) {
+            closure = make_closure_cell(addr, NULL);
+            global_closures[i] = compute_offset(closure);
+            return closure;
+        }
+        if (CLOSURE_ADDR(closure) == addr) {
+            return closure;
+        }
+        i = (i + 1) % MAX_GLOBAL_CLOSURES;
+    }
+
+    return make_closure_cell(addr, NULL);
+}
+
 CELL *make_cons_cell(CELL *cell_car, CELL *cell_cdr) {
     CELL *new_cell;
     int car_offset, cdr_offset;
@@ -189,7 +598,7 @@ CELL *make_cons_cell(CELL *cell_car, CELL *cell_cdr) {
         cdr_offset = compute_offset(cell_cdr);
     }
 
-    new_cell->data = (car_offset << 16) | (cdr_offset);
+    CELL_DATA(new_cell) = (car_offset << 16) | (cdr_offset);
 
     return new_cell;
 }
@@ -210,7 +619,7 @@ int car_int(CELL *cell) {
         panic("Tried to get int CAR of non-int cell");
     }
 
-    return (int) car_cell->data;
+    return (int) CELL_DATA(car_cell);
 }
 
 CELL *car_cell(CELL *cell) {
@@ -240,7 +649,7 @@ int cdr_int(CELL *cell) {
         panic("Tried to get int CDR of non-int cell");
     }
 
-    return (int) cdr_cell->data;
+    return (int) CELL_DATA(cdr_cell);
 }
 
 CELL *cdr_cell(CELL *cell) {
@@ -253,6 +662,136 @@ CELL *cdr_cell(CELL *cell) {
     return cell_for_offset(CDR_OFFSET(cell));
 }
 
+CELL *vector_cell(CELL *cell) {
+    if ((cell == NULL) || (cell->cell_type != TYPE_VECTOR)) {
+        panic("Expected vector");
+    }
+    return cell;
+}
+
+CELL *hash_cell(CELL *cell) {
+    if ((cell == NULL) || (cell->cell_type != TYPE_HASH)) {
+        panic("Expected hash table");
+    }
+    return cell;
+}
+
+CELL *closure_cell(CELL *cell) {
+    if ((cell == NULL) || (cell->cell_type != TYPE_CLOSURE)) {
+        panic("Tried to apply non-closure");
+    }
+    return cell;
+}
+
+/* Copies an argument list into vals, returning how many there are or -1
+ * if the call can't be memoized. */
+int memo_args(CELL *args, int *vals) {
+    int n = 0;
+    CELL *arg;
+
+    while ((args != NULL) && (args->cell_type == TYPE_CONS)) {
+        arg = cell_for_offset(CAR_OFFSET(args));
+        if ((n >= MEMO_MAX_ARGS) || (arg == NULL) ||
+            (arg->cell_type != TYPE_INT)) {
+            return -1;
+        }
+        vals[n++] = (int) CELL_DATA(arg);
+        args = cell_for_offset(CDR_OFFSET(args));
+    }
+    return n;
+}
+
+MEMO_ENTRY *memo_set(int addr, int nargs, int *vals) {
+    uint32_t h;
+
+    h = addr;
+    for (int i=0; i < nargs; i++) {
+        h = h * 31 + (uint32_t) vals[i];
+    }
+    h *= 2654435769u;
+    h ^= h >> 16;
+    return &memo_table[(h % (MEMO_SIZE / MEMO_WAYS)) * MEMO_WAYS];
+}
+
+int memo_matches(MEMO_ENTRY *entry, int addr, int nargs, int *vals) {
+    if (!entry->used || (entry->addr != addr) || (entry->nargs != nargs)) {
+        return 0;
+    }
+    for (int i=0; i < nargs; i++) {
+        if (entry->args[i] != vals[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns the cached result of calling the function at addr with args,
+ * or NULL if there isn't one */
+CELL *memo_lookup(int addr, CELL *args) {
+    int nargs, vals[MEMO_MAX_ARGS];
+    MEMO_ENTRY *set;
+
+    nargs = memo_args(args, vals);
+    if (nargs < 0) {
+        return NULL;
+    }
+    set = memo_set(addr, nargs, vals);
+    for (int i=0; i < MEMO_WAYS; i++) {
+        if (memo_matches(&set[i], addr, nargs, vals)) {
+            set[i].last_used = ++memo_clock;
+            return cell_for_offset(set[i].result);
+        }
+    }
+    return NULL;
+}
+
+/* The key MRTN stores a result under, or NULL if the call can't be
+ * memoized */
+CELL *memo_key(int addr, CELL *args) {
+    int vals[MEMO_MAX_ARGS];
+
+    if (memo_args(args, vals) < 0) {
+        return NULL;
+    }
+    return make_cons_cell(make_int_cell(addr), args);
+}
+
+void memo_store(CELL *key, CELL *result) {
+    int addr, nargs, vals[MEMO_MAX_ARGS];
+    MEMO_ENTRY *set, *victim;
+
+    if (result == NULL) {
+        return;
+    }
+    addr = car_int(key);
+    nargs = memo_args(cdr_cell(key), vals);
+    set = memo_set(addr, nargs, vals);
+
+    victim = &set[0];
+    for (int i=0; i < MEMO_WAYS; i++) {
+        if (memo_matches(&set[i], addr, nargs, vals) || !set[i].used) {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].last_used < victim->last_used) {
+            victim = &set[i];
+        }
+    }
+
+    victim->used = 1;
+    victim->addr = addr;
+    victim->nargs = nargs;
+    memcpy(victim->args, vals, nargs * sizeof(int));
+    victim->result = compute_offset(result);
+    victim->last_used = ++memo_clock;
+}
+
+void check_vector_range(CELL *vec, int start, int len) {
+    if ((start < 0) || (len < 0) || (start + len > VECTOR_LENGTH(vec))) {
+        panic("Vector index out of range");
+    }
+}
+
 CELL *locate(int env_num, int env_offset) {
     CELL *curr_pos;
 
@@ -276,6 +815,120 @@ CELL *locate(int env_num, int env_offset) {
     return car_cell(curr_pos);
 }
 
+int skip_space() {
+    int ch;
+
+    ch = input_char();
+    while ((ch == ' ') || (ch == '\t') || (ch == '\n') || (ch == '\r')) {
+        ch = input_char();
+    }
+    return ch;
+}
+
+CELL *read_int(int ch) {
+    int num, negative;
+
+    negative = 0;
+    if (ch == '-') {
+        negative = 1;
+        ch = input_char();
+    }
+    if ((ch < '0') || (ch > '9')) {
+        panic("Expected integer or ( in input");
+    }
+
+    num = 0;
+    while ((ch >= '0') && (ch <= '9')) {
+        if (num > (INT_MAX - (ch - '0')) / 10) {
+            panic("Integer out of range in input");
+        }
+        num = num * 10 + (ch - '0');
+        ch = input_char();
+    }
+    unread_char(ch);
+
+    return make_int_cell(negative ? -num : num);
+}
+
+/* Reads the next integer or s-expression from the input stream. Each
+ * unfinished list is a (head . tail) frame on a stack kept under a single
+ * root, so nesting is limited only by the heap. */
+CELL *read_value() {
+    int ch;
+    CELL *stack = NULL, *frame, *value, *tail, *new_tail;
+
+    push_root(&stack);
+    while (1) {
+        /* Everything read so far is reachable from stack here */
+        reserve_cells(GC_RESERVE);
+
+        ch = skip_space();
+        if (ch == '(') {
+            stack = make_cons_cell(make_cons_cell(NULL, NULL), stack);
+            continue;
+        }
+
+        if ((ch == ')') && (stack != NULL)) {
+            value = cell_for_offset(CAR_OFFSET(car_cell(stack)));
+            stack = cdr_cell(stack);
+        } else if ((ch == EOF) && (stack != NULL)) {
+            panic("Unexpected end of input in list");
+        } else {
+            value = read_int(ch);
+        }
+
+        if (stack == NULL) {
+            break;
+        }
+
+        frame = car_cell(stack);
+        tail = cell_for_offset(CDR_OFFSET(frame));
+        new_tail = make_cons_cell(value, NULL);
+        if (tail == NULL) {
+            CELL_DATA(frame) = (compute_offset(new_tail) << 16) | compute_offset(new_tail);
+        } else {
+            CELL_DATA(tail) = (CAR_OFFSET(tail) << 16) | compute_offset(new_tail);
+            CELL_DATA(frame) = (CAR_OFFSET(frame) << 16) | compute_offset(new_tail);
+        }
+    }
+    pop_root();
+
+    return value;
+}
+
+int at_end_of_input() {
+    int ch;
+
+    ch = skip_space();
+    if (ch == EOF) {
+        return 1;
+    }
+    unread_char(ch);
+    return 0;
+}
+
+void trace_instruction(int pc, int instr) {
+    TRACE_RECORD *record;
+
+    record = &trace_ring[trace_next % TRACE_SIZE];
+    record->pc = pc;
+    record->opcode = instr;
+    record->dump_depth = (dump_depth > 0xffff) ? 0xffff : dump_depth;
+    record->free_cells = free_count;
+    record->alloc_count = alloc_count;
+    trace_next++;
+}
+
+/* Writes out the trace ring buffer, oldest record first */
+void dump_trace() {
+    uint32_t first;
+
+    first = (trace_next > TRACE_SIZE) ? trace_next - TRACE_SIZE : 0;
+    for (uint32_t i=first; i < trace_next; i++) {
+        write_trace_record(&trace_ring[i % TRACE_SIZE]);
+    }
+}
+
 void set_code_pos(int new_pos) {
     CELL *code_pos_cell;
 
@@ -284,14 +937,68 @@ void set_code_pos(int new_pos) {
     }
 
     code_pos_cell = car_cell(C);
-    code_pos_cell->data = (unsigned long) new_pos;
+    CELL_DATA(code_pos_cell) = (uint32_t) new_pos;
 }
 
-void execute() {
+/* Process 0 is the program itself and keeps its slot after it finishes
+ * so its final stack can be read back. */
+int new_process() {
+    for (int i=1; i < MAX_PROCESSES; i++) {
+        if ((processes[i].state == PROC_FREE) ||
+            (processes[i].state == PROC_DONE)) {
+            memset(&processes[i], 0, sizeof(PROCESS));
+            processes[i].state = PROC_RUNNABLE;
+            return i;
+        }
+    }
+    panic("Too many processes");
+    return -1;
+}
+
+/* Appends msg to the mailbox of pid, waking it if it is waiting */
+void send_message(int pid, CELL *msg) {
+    PROCESS *proc;
+    CELL *new_tail;
+
+    if ((pid < 0) || (pid >= MAX_PROCESSES) ||
+        (processes[pid].state == PROC_FREE)) {
+        panic("Send to invalid process");
+    }
+    proc = &processes[pid];
+    if (proc->state == PROC_DONE) {
+        return;
+    }
+
+    new_tail = make_cons_cell(msg, NULL);
+    if (proc->mailbox == NULL) {
+        proc->mailbox = new_tail;
+    } else {
+        CELL_DATA(proc->mailbox_tail) =
+            (CAR_OFFSET(proc->mailbox_tail) << 16) | compute_offset(new_tail);
+    }
+    proc->mailbox_tail = new_tail;
+
+    if (proc->state == PROC_BLOCKED) {
+        proc->state = PROC_RUNNABLE;
+    }
+}
+
+/* Runs the current process for up to budget instructions and returns
+ * whether it is still runnable, waiting on RECV or finished. */
+int run_process(int budget) {
     int instr, x, y, z, env_num, env_offset, code_pos, t, f;
     CELL *loc, *loc2, *loc3;
 
     while (C != NULL) {
+        if (budget-- <= 0) {
+            return PROC_RUNNABLE;
+        }
+
+        /* Collect between instructions, while everything live is reachable
+         * from the registers, rather than in the middle of one. An
+         * instruction may then allocate up to GC_RESERVE cells. */
+        reserve_cells(GC_RESERVE);
+
 #ifdef DEBUG
         printf("S: ");
         print_cell(S);
@@ -308,6 +1015,14 @@ void execute() {
         instr = code[code_pos++];
         set_code_pos(code_pos);
 
+        if (trace_enabled) {
+            trace_instruction(code_pos - 1, instr);
+        }
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            dump_trace();
+        }
+
 #ifdef DEBUG
         printf("Instr %s\n", instrs[instr]);
 #endif
@@ -468,6 +1183,7 @@ void execute() {
                 set_code_pos(code_pos);
 
                 D = make_cons_cell(C, D);
+                dump_depth++;
                 if (x) {
                     C = make_cons_cell(make_int_cell(t), C);
                 } else {
@@ -501,6 +1217,7 @@ void execute() {
             case INSTR_JOIN:
                 C = car_cell(D);
                 D = cdr_cell(D);
+                dump_depth--;
                 break;
 
             case INSTR_LDF:
@@ -512,33 +1229,80 @@ void execute() {
 
                 set_code_pos(code_pos);
 
-                S = make_cons_cell(make_cons_cell(make_int_cell(y), E), S);
+                S = make_cons_cell(make_closure_cell(y, E), S);
                 break;
 
-            case INSTR_AP:
-                loc = car_cell(S);
-                S = cdr_cell(S);
+            case INSTR_LDG:
+                y = 0;
+                for (int i=0; i < 4; i++) {
+                    x = code[code_pos++];
+                    y = (y << 8) + x;
+                }
+
+                set_code_pos(code_pos);
 
+                S = make_cons_cell(global_closure(y), S);
+                break;
+
+            case INSTR_AP:
                 x = code[code_pos++];
                 set_code_pos(code_pos);
 
+                /* One cell per argument plus the frame, before popping */
+                reserve_cells(x + CALL_CELLS);
+
+                loc = closure_cell(car_cell(S));
+                S = cdr_cell(S);
+
                 loc2 = make_nil_cell();
                 for (int i=0; i < x; i++) {
                     loc2 = make_cons_cell(car_cell(S), loc2);
                     S = cdr_cell(S);
                 }
 
+                if (code[CLOSURE_ADDR(loc)] == INSTR_MEMO) {
+                    loc3 = memo_lookup(CLOSURE_ADDR(loc), loc2);
+                    if (loc3 != NULL) {
+                        S = make_cons_cell(loc3, S);
+                        break;
+                    }
+                    D = make_cons_cell(memo_key(CLOSURE_ADDR(loc), loc2), D);
+                }
+
                 D = make_cons_cell(S, make_cons_cell(E, make_cons_cell(C, D)));
+                dump_depth++;
 
                 S = make_nil_cell();
-                E = make_cons_cell(loc2, cdr_cell(loc));
-                C = make_cons_cell(make_int_cell(car_int(loc)), make_nil_cell());
+                E = make_cons_cell(loc2, CLOSURE_ENV(loc));
+                C = make_cons_cell(make_int_cell(CLOSURE_ADDR(loc)), make_nil_cell());
 
                 break;
 
 
             case INSTR_RTN:
-                if (D == NULL) return;
+                if (D == NULL) return PROC_DONE;
+
+                loc = car_cell(S);
+
+                S = make_cons_cell(loc, car_cell(D));
+                D = cdr_cell(D);
+
+                E = car_cell(D);
+                D = cdr_cell(D);
+
+                C = car_cell(D);
+                D = cdr_cell(D);
+                dump_depth--;
+                break;
+
+            case INSTR_MEMO:
+                /* Only marks the entry of a memoized function for AP/RAP */
+                break;
+
+            case INSTR_MRTN:
+                /* RTN, then cache the result under the key AP/RAP left
+                 * below the return frame */
+                if (D == NULL) return PROC_DONE;
 
                 loc = car_cell(S);
 
@@ -550,12 +1314,21 @@ void execute() {
 
                 C = car_cell(D);
                 D = cdr_cell(D);
+                dump_depth--;
+
+                loc2 = car_cell(D);
+                D = cdr_cell(D);
+                if (loc2 != NULL) {
+                    memo_store(loc2, loc);
+                }
                 break;
                 
             case INSTR_DUM:
                 x = code[code_pos++];
                 set_code_pos(code_pos);
 
+                reserve_cells(2 * x + CALL_CELLS);
+
                 loc = make_nil_cell();
                 for (int i=0; i < x; i++) {
                     loc = make_cons_cell(make_int_cell(0), loc);
@@ -565,12 +1338,15 @@ void execute() {
                 break;
 
             case INSTR_RAP:
-                loc = car_cell(S);
-                S = cdr_cell(S);
-
                 x = code[code_pos++];
                 set_code_pos(code_pos);
 
+                /* One cell per argument plus the frame, before popping */
+                reserve_cells(x + CALL_CELLS);
+
+                loc = closure_cell(car_cell(S));
+                S = cdr_cell(S);
+
                 loc2 = make_nil_cell();
                 for (int i=0; i < x; i++) {
                     loc2 = make_cons_cell(car_cell(S), loc2);
@@ -579,20 +1355,400 @@ void execute() {
                 E = cdr_cell(E);
                 E = make_cons_cell(loc2, E);
 
+                if (code[CLOSURE_ADDR(loc)] == INSTR_MEMO) {
+                    loc3 = memo_lookup(CLOSURE_ADDR(loc), loc2);
+                    if (loc3 != NULL) {
+                        S = make_cons_cell(loc3, S);
+                        break;
+                    }
+                    D = make_cons_cell(memo_key(CLOSURE_ADDR(loc), loc2), D);
+                }
+
                 D = make_cons_cell(S, make_cons_cell(E, make_cons_cell(C, D)));
+                dump_depth++;
+
+                S = make_nil_cell();
+                E = make_cons_cell(loc2, CLOSURE_ENV(loc));
+                C = make_cons_cell(make_int_cell(CLOSURE_ADDR(loc)), make_nil_cell());
+
+                break;
+
+            case INSTR_TAP:
+                /* A tail call keeps the caller's return frame instead of
+                 * pushing a new one, so a loop runs in constant space. */
+                x = code[code_pos++];
+                set_code_pos(code_pos);
+
+                reserve_cells(x + CALL_CELLS);
+
+                loc = closure_cell(car_cell(S));
+                S = cdr_cell(S);
+
+                loc2 = make_nil_cell();
+                for (int i=0; i < x; i++) {
+                    loc2 = make_cons_cell(car_cell(S), loc2);
+                    S = cdr_cell(S);
+                }
+
+                if (code[CLOSURE_ADDR(loc)] == INSTR_MEMO) {
+                    loc3 = memo_lookup(CLOSURE_ADDR(loc), loc2);
+                    if (loc3 != NULL) {
+                        /* Hand the cached result straight to our caller */
+                        if (D == NULL) {
+                            S = make_cons_cell(loc3, S);
+                            return PROC_DONE;
+                        }
+                        S = make_cons_cell(loc3, car_cell(D));
+                        D = cdr_cell(D);
+
+                        E = car_cell(D);
+                        D = cdr_cell(D);
+
+                        C = car_cell(D);
+                        D = cdr_cell(D);
+                        dump_depth--;
+                        break;
+                    }
+
+                    /* MRTN expects its key just below the return frame,
+                     * so slip it in under the caller's frame. */
+                    if (D != NULL) {
+                        loc3 = cdr_cell(cdr_cell(cdr_cell(D)));
+                        loc3 = make_cons_cell(memo_key(CLOSURE_ADDR(loc), loc2), loc3);
+                        D = make_cons_cell(car_cell(D),
+                                           make_cons_cell(car_cell(cdr_cell(D)),
+                                                          make_cons_cell(car_cell(cdr_cell(cdr_cell(D))), loc3)));
+                    }
+                }
 
                 S = make_nil_cell();
-                E = make_cons_cell(loc2, cdr_cell(loc));
-                C = make_cons_cell(make_int_cell(car_int(loc)), make_nil_cell());
+                E = make_cons_cell(loc2, CLOSURE_ENV(loc));
+                C = make_cons_cell(make_int_cell(CLOSURE_ADDR(loc)), make_nil_cell());
+
+                break;
+
+            case INSTR_VMAKE:
+                x = code[code_pos++];
+                set_code_pos(code_pos);
+
+                /* Leave the fill value on S until the vector exists so a
+                 * collection while allocating cannot reclaim it. */
+                loc = car_cell(S);
+                y = car_int(cdr_cell(S));
+
+                loc = make_vector_cell(x, y, loc);
+                S = make_cons_cell(loc, cdr_cell(cdr_cell(S)));
+                break;
+
+            case INSTR_VREF:
+                x = car_int(S);
+                S = cdr_cell(S);
+                loc = vector_cell(car_cell(S));
+                S = cdr_cell(S);
+
+                check_vector_range(loc, x, 1);
+                y = VECTOR_SLOTS(loc)[x];
+                if (VECTOR_KIND(loc) == VECTOR_INT) {
+                    S = make_cons_cell(make_int_cell(y), S);
+                } else {
+                    S = make_cons_cell(cell_for_offset(y), S);
+                }
+                break;
+
+            case INSTR_VSET:
+                loc2 = car_cell(S);
+                S = cdr_cell(S);
+                x = car_int(S);
+                S = cdr_cell(S);
+                loc = vector_cell(car_cell(S));
+
+                check_vector_range(loc, x, 1);
+                if (VECTOR_KIND(loc) == VECTOR_INT) {
+                    if ((loc2 == NULL) || (loc2->cell_type != TYPE_INT)) {
+                        panic("Tried to store non-int in int vector");
+                    }
+                    VECTOR_SLOTS(loc)[x] = (int) CELL_DATA(loc2);
+                } else {
+                    VECTOR_SLOTS(loc)[x] = compute_offset(loc2);
+                }
+                break;
+
+            case INSTR_VLEN:
+                loc = vector_cell(car_cell(S));
+                S = cdr_cell(S);
 
+                S = make_cons_cell(make_int_cell(VECTOR_LENGTH(loc)), S);
+                break;
+
+            case INSTR_VFILL:
+                loc2 = car_cell(S);
+                S = cdr_cell(S);
+                loc = vector_cell(car_cell(S));
+
+                if (VECTOR_KIND(loc) == VECTOR_INT) {
+                    if ((loc2 == NULL) || (loc2->cell_type != TYPE_INT)) {
+                        panic("Tried to fill int vector with non-int");
+                    }
+                    y = (int) CELL_DATA(loc2);
+                } else {
+                    y = compute_offset(loc2);
+                }
+
+                {
+                    int *slots = VECTOR_SLOTS(loc);
+                    int len = VECTOR_LENGTH(loc);
+
+                    for (int i=0; i < len; i++) {
+                        slots[i] = y;
+                    }
+                }
+                break;
+
+            case INSTR_VCOPY:
+                /* dst at src start end -- copies src[start..end) to dst[at..] */
+                z = car_int(S);
+                S = cdr_cell(S);
+                y = car_int(S);
+                S = cdr_cell(S);
+                loc2 = vector_cell(car_cell(S));
+                S = cdr_cell(S);
+                x = car_int(S);
+                S = cdr_cell(S);
+                loc = vector_cell(car_cell(S));
+
+                if (VECTOR_KIND(loc) != VECTOR_KIND(loc2)) {
+                    panic("Tried to copy between different vector kinds");
+                }
+                check_vector_range(loc2, y, z - y);
+                check_vector_range(loc, x, z - y);
+                memmove(&VECTOR_SLOTS(loc)[x], &VECTOR_SLOTS(loc2)[y],
+                        (z - y) * sizeof(int));
+                break;
+
+            case INSTR_READ:
+                if (at_end_of_input()) {
+                    panic("Read past end of input");
+                }
+                loc = read_value();
+                push_root(&loc);
+                S = make_cons_cell(loc, S);
+                pop_root();
+                break;
+
+            case INSTR_WRITE:
+                write_value(car_cell(S));
+                break;
+
+            case INSTR_EOFP:
+                S = make_cons_cell(make_int_cell(at_end_of_input()), S);
+                break;
+
+            case INSTR_HMAKE:
+                x = car_int(S);
+                S = cdr_cell(S);
+
+                S = make_cons_cell(make_hash_cell(x), S);
+                break;
+
+            case INSTR_HGET:
+                loc3 = car_cell(S);
+                S = cdr_cell(S);
+                x = car_int(S);
+                S = cdr_cell(S);
+                loc = hash_cell(car_cell(S));
+                S = cdr_cell(S);
+
+                {
+                    int *entry = hash_lookup(loc, x);
+
+                    if (entry != NULL) {
+                        loc3 = cell_for_offset(entry[2]);
+                    }
+                }
+                S = make_cons_cell(loc3, S);
+                break;
+
+            case INSTR_HPUT:
+                /* The table and value stay on S while the table may grow */
+                loc2 = car_cell(S);
+                x = car_int(cdr_cell(S));
+                loc = hash_cell(car_cell(cdr_cell(cdr_cell(S))));
+
+                hash_put(loc, x, loc2);
+                S = cdr_cell(cdr_cell(S));
+                break;
+
+            case INSTR_HDEL:
+                x = car_int(S);
+                S = cdr_cell(S);
+                loc = hash_cell(car_cell(S));
+
+                hash_delete(loc, x);
+                break;
+
+            case INSTR_HSIZE:
+                loc = hash_cell(car_cell(S));
+                S = cdr_cell(S);
+
+                S = make_cons_cell(make_int_cell(HASH_COUNT(loc)), S);
+                break;
+
+            case INSTR_SPAWN:
+                x = code[code_pos++];
+                set_code_pos(code_pos);
+
+                reserve_cells(x + CALL_CELLS);
+
+                loc = closure_cell(car_cell(S));
+                S = cdr_cell(S);
+
+                y = new_process();
+                loc2 = make_nil_cell();
+                for (int i=0; i < x; i++) {
+                    loc2 = make_cons_cell(car_cell(S), loc2);
+                    S = cdr_cell(S);
+                }
+
+                processes[y].S = make_nil_cell();
+                processes[y].E = make_cons_cell(loc2, CLOSURE_ENV(loc));
+                processes[y].C = make_cons_cell(make_int_cell(CLOSURE_ADDR(loc)),
+                                                make_nil_cell());
+
+                S = make_cons_cell(make_int_cell(y), S);
+                break;
+
+            case INSTR_SEND:
+                loc = car_cell(S);
+                x = car_int(cdr_cell(S));
+
+                send_message(x, loc);
+                S = make_cons_cell(loc, cdr_cell(cdr_cell(S)));
+                break;
+
+            case INSTR_RECV:
+                loc = processes[current_process].mailbox;
+                if (loc == NULL) {
+                    /* Run RECV again once a message arrives */
+                    set_code_pos(code_pos - 1);
+                    return PROC_BLOCKED;
+                }
+                processes[current_process].mailbox = cdr_cell(loc);
+
+                S = make_cons_cell(car_cell(loc), S);
+                break;
+
+            case INSTR_SELF:
+                S = make_cons_cell(make_int_cell(current_process), S);
+                break;
+
+            case INSTR_CALLHOST:
+                x = code[code_pos++];
+                y = code[code_pos++];
+                set_code_pos(code_pos);
+
+                if ((x >= MAX_HOST_FUNCTIONS) || (host_functions[x] == NULL)) {
+                    panic("Unknown host function");
+                }
+                if (y > MAX_HOST_ARGS) {
+                    panic("Too many host function arguments");
+                }
+
+                /* The arguments stay on S until the function returns */
+                {
+                    CELL *args[MAX_HOST_ARGS];
+
+                    loc = S;
+                    for (int i=y-1; i >= 0; i--) {
+                        args[i] = car_cell(loc);
+                        loc = cdr_cell(loc);
+                    }
+                    loc3 = host_values;
+                    loc2 = host_functions[x](args, y);
+                }
+
+                push_root(&loc2);
+                S = make_cons_cell(loc2, loc);
+                pop_root();
+                /* Drop whatever the function made apart from its result */
+                host_values = loc3;
                 break;
 
             case INSTR_STOP:
-                return;
+                return PROC_DONE;
+        }
+
+    }
+
+    return PROC_DONE;
+}
+
+void save_registers(int pid) {
+    processes[pid].S = S;
+    processes[pid].E = E;
+    processes[pid].C = C;
+    processes[pid].D = D;
+    processes[pid].dump_depth = dump_depth;
+}
+
+void release_process(int pid) {
+    processes[pid].S = NULL;
+    processes[pid].E = NULL;
+    processes[pid].C = NULL;
+    processes[pid].D = NULL;
+    processes[pid].dump_depth = 0;
+    processes[pid].mailbox = NULL;
+    processes[pid].mailbox_tail = NULL;
+}
+
+void load_registers(int pid) {
+    S = processes[pid].S;
+    E = processes[pid].E;
+    C = processes[pid].C;
+    D = processes[pid].D;
+    dump_depth = processes[pid].dump_depth;
+}
+
+/* Runs the program loaded into the registers as process 0, switching
+ * round robin between it and any processes it spawns every TIME_SLICE
+ * instructions. Returns once no process can run, with process 0's
+ * registers loaded. */
+void execute() {
+    int next;
+
+    memset(processes, 0, sizeof(processes));
+    current_process = 0;
+    processes[0].state = PROC_RUNNABLE;
+    dump_depth = 0;
+
+    while (1) {
+        processes[current_process].state = run_process(TIME_SLICE);
+
+        next = -1;
+        for (int i=1; i <= MAX_PROCESSES; i++) {
+            int pid = (current_process + i) % MAX_PROCESSES;
+
+            if (processes[pid].state == PROC_RUNNABLE) {
+                next = pid;
+                break;
+            }
         }
 
+        save_registers(current_process);
+        /* Only process 0's final stack is wanted, so a finished process
+         * must not keep anything alive. */
+        if ((current_process != 0) &&
+            (processes[current_process].state == PROC_DONE)) {
+            release_process(current_process);
+        }
+        if (next < 0) {
+            break;
+        }
+        current_process = next;
+        load_registers(current_process);
     }
 
+    current_process = 0;
+    load_registers(0);
 }
 
 CELL *reverse(CELL *lst) {
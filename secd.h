@@ -1,27 +1,163 @@
 void initialize_pool();
 void execute();
+void dump_trace();
 
+/* The heap is a struct of arrays. cell_pool holds only the type of each
+ * cell, so a CELL * still names a cell by its index in cell_pool, while
+ * the car/cdr offsets or value live in cell_data and the collector's mark
+ * bits in mark_bits. */
 typedef struct _CELL {
-    unsigned char tag;
     unsigned char cell_type;
-    unsigned char unused0;
-    unsigned char unused1;
-    unsigned long data;
 } CELL;
 
+/* A native function callable from programs through CALLHOST. args[0] is
+ * the first argument; the args stay reachable while the function runs,
+ * as does anything it adds to host_values. */
+typedef CELL *(*HOST_FUNCTION)(CELL **args, int nargs);
+
+int register_host_function(int id, HOST_FUNCTION fn);
+
 CELL *make_cons_cell(CELL *, CELL*);
 CELL *make_int_cell(int);
 CELL *make_nil_cell();
+CELL *make_vector_cell(int, int, CELL *);
+CELL *make_hash_cell(int);
+CELL *make_closure_cell(int, CELL *);
 CELL *cell_for_offset(int);
 CELL *reverse(CELL *);
+CELL *read_value();
+void push_root(CELL **);
+void pop_root();
+void reserve_cells(int);
 
 #define TYPE_CONS 0
 #define TYPE_INT 1
 #define TYPE_NIL 2
+#define TYPE_VECTOR 3
+#define TYPE_HASH 4
+#define TYPE_CLOSURE 5
+
+#define VECTOR_INT 0
+#define VECTOR_VALUE 1
+
+#define CELL_DATA(c) (cell_data[(c) - cell_pool])
+
+#define CAR_OFFSET(c) ((CELL_DATA(c) >> 16) & 0xffff)
+#define CDR_OFFSET(c) (CELL_DATA(c) & 0xffff)
+
+#define CLOSURE_ADDR(c) ((int) ((CELL_DATA(c) >> 16) & 0xffff))
+#define CLOSURE_ENV(c) cell_for_offset(CELL_DATA(c) & 0xffff)
+
+/* A vector cell holds its kind and the index of its block in vector_pool.
+ * Each block is a two slot header (owner cell offset, length) followed by
+ * the slots themselves. Int vectors hold the values directly, value vectors
+ * hold cell offsets. */
+#define VECTOR_KIND(c) ((CELL_DATA(c) >> 16) & 0xff)
+#define VECTOR_START(c) (CELL_DATA(c) & 0xffff)
+#define VECTOR_LENGTH(c) (vector_pool[VECTOR_START(c)+1])
+#define VECTOR_SLOTS(c) (&vector_pool[VECTOR_START(c)+2])
+
+#define HAS_BLOCK(c) ((c->cell_type == TYPE_VECTOR) || (c->cell_type == TYPE_HASH))
+
+/* A hash table keeps its block the same way, holding the live entry count,
+ * the count of entries ever used (live or deleted) and then an open
+ * addressed array of (state, key, value offset) entries. */
+#define HASH_EMPTY 0
+#define HASH_FULL 1
+#define HASH_DELETED 2
+#define HASH_MIN_CAPACITY 8
+/* The most entries a single block can hold, owner and length included */
+#define HASH_MAX_CAPACITY ((MAX_VECTOR_SLOTS - 4) / 3)
 
-#define CAR_OFFSET(c) ((c->data >> 16) & 0xffff)
-#define CDR_OFFSET(c) (c->data & 0xffff)
+#define HASH_COUNT(c) (vector_pool[VECTOR_START(c)+2])
+#define HASH_USED(c) (vector_pool[VECTOR_START(c)+3])
+#define HASH_CAPACITY(c) ((VECTOR_LENGTH(c) - 2) / 3)
+#define HASH_ENTRIES(c) (&vector_pool[VECTOR_START(c)+4])
+#define HASH_BLOCK_LENGTH(cap) (2 + (cap) * 3)
 
 #define MAX_CELLS 1000
+#define MARK_WORDS ((MAX_CELLS + 31) / 32)
 #define MAX_CODE_SIZE 1000
+#define MAX_VECTOR_SLOTS 1000
+#define MAX_ROOTS 16
+#define GC_RESERVE 64
+#define CALL_CELLS 16
+#define MAX_HOST_FUNCTIONS 32
+#define MAX_HOST_ARGS 16
+#define MAX_GLOBAL_CLOSURES 64
+
+/* One executed instruction, as kept in the trace ring buffer */
+typedef struct _TRACE_RECORD {
+    uint16_t pc;
+    uint8_t opcode;
+    uint8_t unused;
+    uint16_t free_cells;
+    uint16_t dump_depth;
+    uint32_t alloc_count;
+} TRACE_RECORD;
+
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 256
+#endif
+
+/* A lightweight VM process. The running process's registers live in the
+ * S/E/C/D globals and are only saved here when it is switched out. */
+typedef struct _PROCESS {
+    int state;
+    CELL *S;
+    CELL *E;
+    CELL *C;
+    CELL *D;
+    int dump_depth;
+    CELL *mailbox;
+    CELL *mailbox_tail;
+} PROCESS;
+
+#define PROC_FREE 0
+#define PROC_RUNNABLE 1
+#define PROC_BLOCKED 2
+#define PROC_DONE 3
+
+#ifndef MAX_PROCESSES
+#define MAX_PROCESSES 32
+#endif
+#ifndef TIME_SLICE
+#define TIME_SLICE 100
+#endif
+
+/* A cached result of a memoized function, keyed on its code address and
+ * integer arguments. The table is MEMO_WAYS way set associative and
+ * evicts the least recently used entry of a full set. */
+#ifndef MEMO_SIZE
+#define MEMO_SIZE 64
+#endif
+#ifndef MEMO_WAYS
+#define MEMO_WAYS 4
+#endif
+#if MEMO_WAYS < 1
+#error "MEMO_WAYS must be at least 1"
+#elif MEMO_SIZE < MEMO_WAYS
+#error "MEMO_SIZE must be at least MEMO_WAYS"
+#elif MEMO_SIZE % MEMO_WAYS != 0
+#error "MEMO_SIZE must be a multiple of MEMO_WAYS"
+#endif
+#define MEMO_MAX_ARGS 4
+
+typedef struct _MEMO_ENTRY {
+    uint16_t addr;
+    uint8_t used;
+    uint8_t nargs;
+    int args[MEMO_MAX_ARGS];
+    uint16_t result;
+    uint32_t last_used;
+} MEMO_ENTRY;
+
+extern volatile int trace_enabled;
+extern volatile int trace_dump_requested;
+
+extern CELL cell_pool[MAX_CELLS];
+extern uint32_t cell_data[MAX_CELLS];
+extern uint32_t mark_bits[MARK_WORDS];
+extern int vector_pool[MAX_VECTOR_SLOTS];
+extern CELL *host_values;
 
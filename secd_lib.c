@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "secd.h"
+#include "libsecd.h"
+
+extern CELL *S, *E, *C, *D;
+extern unsigned char code[MAX_CODE_SIZE];
+extern int root_count;
+extern int free_count;
+
+void collect_garbage();
+
+jmp_buf call_env;
+int in_call = 0;
+char *error_message = NULL;
+
+/* A panic inside secd_call unwinds back to it and becomes its error.
+ * Every other entry point checks for what would panic and returns an
+ * error itself, so the abort is only reached through a bug. */
+void panic(char *message) {
+    error_message = message;
+    if (in_call) {
+        longjmp(call_env, 1);
+    }
+    fprintf(stderr, "libsecd: %s\n", message);
+    abort();
+}
+
+int secd_load(const unsigned char *bytecode, int len) {
+    if ((len < 0) || (len > MAX_CODE_SIZE)) {
+        error_message = "No more code space";
+        return SECD_ERROR;
+    }
+
+    memset(code, 0, sizeof(code));
+    memcpy(code, bytecode, len);
+
+    S = NULL;
+    E = NULL;
+    C = NULL;
+    D = NULL;
+    initialize_pool();
+    error_message = NULL;
+
+    return SECD_OK;
+}
+
+/* reserve_cells for the entry points, which must not panic outside a call */
+int reserve_host_cells(int n) {
+    if (in_call) {
+        reserve_cells(n);
+        return SECD_OK;
+    }
+    if (free_count < n) {
+        collect_garbage();
+        if (free_count < n) {
+            error_message = "out of memory";
+            return SECD_ERROR;
+        }
+    }
+    return SECD_OK;
+}
+
+/* Keeps a value made for the host reachable until the next secd_call, or
+ * inside a host function until that function returns. */
+CELL *host_value(CELL *cell) {
+    host_values = make_cons_cell(cell, host_values);
+    return cell;
+}
+
+/* Enters the function at entry the way AP would, with args as its frame,
+ * and runs until it returns. */
+int secd_call(int entry, CELL **args, int nargs, CELL **result) {
+    CELL *arg_list = NULL;
+    int saved_roots;
+
+    if (in_call) {
+        error_message = "Nested secd_call";
+        return SECD_ERROR;
+    }
+    if ((entry < 0) || (entry >= MAX_CODE_SIZE)) {
+        error_message = "Invalid entry point";
+        return SECD_ERROR;
+    }
+    if (nargs < 0) {
+        error_message = "Negative argument count";
+        return SECD_ERROR;
+    }
+
+    saved_roots = root_count;
+    if (setjmp(call_env)) {
+        in_call = 0;
+        root_count = saved_roots;
+        S = NULL;
+        E = NULL;
+        C = NULL;
+        D = NULL;
+        host_values = NULL;
+        return SECD_ERROR;
+    }
+    in_call = 1;
+
+    /* The args are host values, so the heap can be collected before they
+     * are copied into the frame; the frame itself is rooted meanwhile. */
+    S = NULL;
+    E = NULL;
+    C = NULL;
+    D = NULL;
+    reserve_cells(nargs + CALL_CELLS);
+    push_root(&arg_list);
+    for (int i=nargs-1; i >= 0; i--) {
+        arg_list = make_cons_cell(args[i], arg_list);
+    }
+
+    E = make_cons_cell(arg_list, NULL);
+    C = make_cons_cell(make_int_cell(entry), NULL);
+    pop_root();
+
+    /* The VM holds everything the host passed in from here on */
+    host_values = NULL;
+
+    execute();
+
+    if ((S != NULL) && (S->cell_type == TYPE_CONS)) {
+        *result = cell_for_offset(CAR_OFFSET(S));
+    } else {
+        *result = NULL;
+    }
+    reserve_cells(1);
+    host_value(*result);
+    in_call = 0;
+
+    return SECD_OK;
+}
+
+const char *secd_error() {
+    return error_message;
+}
+
+int secd_register(int id, HOST_FUNCTION fn) {
+    if (register_host_function(id, fn) < 0) {
+        error_message = "Invalid host function id";
+        return SECD_ERROR;
+    }
+    return SECD_OK;
+}
+
+CELL *secd_int(int i) {
+    if (reserve_host_cells(2) < 0) {
+        return NULL;
+    }
+    return host_value(make_int_cell(i));
+}
+
+CELL *secd_cons(CELL *car, CELL *cdr) {
+    if (reserve_host_cells(2) < 0) {
+        return NULL;
+    }
+    return host_value(make_cons_cell(car, cdr));
+}
+
+int secd_is_int(CELL *cell) {
+    return (cell != NULL) && (cell->cell_type == TYPE_INT);
+}
+
+int secd_is_cons(CELL *cell) {
+    return (cell != NULL) && (cell->cell_type == TYPE_CONS);
+}
+
+int secd_int_value(CELL *cell) {
+    return secd_is_int(cell) ? (int) CELL_DATA(cell) : 0;
+}
+
+CELL *secd_car(CELL *cell) {
+    return secd_is_cons(cell) ? cell_for_offset(CAR_OFFSET(cell)) : NULL;
+}
+
+CELL *secd_cdr(CELL *cell) {
+    return secd_is_cons(cell) ? cell_for_offset(CDR_OFFSET(cell)) : NULL;
+}
+
+int secd_protect(CELL **cell) {
+    if (root_count >= MAX_ROOTS) {
+        error_message = "Too many GC roots";
+        return SECD_ERROR;
+    }
+    push_root(cell);
+    return SECD_OK;
+}
+
+void secd_unprotect() {
+    if (root_count > 0) {
+        pop_root();
+    }
+}
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <signal.h>
 
 #include "secd.h"
 
@@ -12,82 +14,16 @@ void print_cell(CELL *cell);
 void panic(char *message) {
     printf("%s\n", message);
     fflush(stdout);
+    dump_trace();
     exit(1);
 }
 
-void print_cell(CELL *cell) {
-    int printed_first;
-    if (cell == NULL) return;
-
-    switch (cell->cell_type) {
-        case TYPE_INT:
-            printf("%d", (int) cell->data);
-            break;
-        case TYPE_NIL:
-            printf("NIL");
-            break;
-
-        case TYPE_CONS:
-            printf("(");
-            printed_first = 0;
-            while (cell != NULL) {
-                if (printed_first) printf(" ");
-                print_cell(cell_for_offset(CAR_OFFSET(cell)));
-                printed_first = 1;
-                cell = cell_for_offset(CDR_OFFSET(cell));
-                if (cell == NULL) break;
-                if (cell->cell_type == TYPE_INT) {
-                    printf(" . %d", (int) cell->data);
-                    break;
-                }
-            }
-            printf(")");
-            break;
-    }
+void request_trace_dump(int sig) {
+    trace_dump_requested = 1;
 }
 
-CELL *read_sexpr() {
-    char ch;
-    int num, in_num;
-    CELL *curr_list;
-
-    curr_list = NULL;
-
-    ch = getchar();
-    if (ch != '(') {
-        panic("Expected ( to start sexpr");
-    }
-
-    num = 0;
-    in_num = 0;
-    while (1) {
-        ch = getchar();
-        if ((ch >= '0') && (ch <= '9')) {
-            if (!in_num) {
-                in_num = 1;
-                num = 0;
-            }
-            num = num * 10 + (ch - '0');
-            in_num = 1;
-        } else if (ch == ' ') {
-            if (in_num) {
-                curr_list = make_cons_cell(make_int_cell(num), curr_list);
-                in_num = 0;
-            }
-        } else if (ch == ')') {
-            if (in_num) {
-                curr_list = make_cons_cell(make_int_cell(num), curr_list);
-                in_num = 0;
-            }
-            return reverse(curr_list);
-        } else if (ch == '(') {
-            ungetc('(', stdin);
-            curr_list = make_cons_cell(read_sexpr(), curr_list);
-        } else if (ch == '\n') {
-        } else {
-            printf("Unknown character: %c\n", ch);
-        }
-    }
+void toggle_trace(int sig) {
+    trace_enabled = !trace_enabled;
 }
 
 void skip_newline() {
@@ -102,15 +38,25 @@ void skip_newline() {
 
 int main(int argc, char *argv[]) {
     CELL *foo, *bar, *baz, *the_list;
-    int i, ch;
+    int i, ch, arg;
     FILE *infile;
 
-    if (argc < 2) {
+    arg = 1;
+    if ((argc > arg) && (strcmp(argv[arg], "-t") == 0)) {
+        trace_enabled = 1;
+        arg++;
+    }
+
+    if (argc <= arg) {
         printf("Please supply a filename\n");
         return 0;
     }
 
-    if ((infile = fopen(argv[1], "rb")) == NULL) {
+    /* SIGUSR1 dumps the trace buffer, SIGUSR2 turns tracing on or off */
+    signal(SIGUSR1, request_trace_dump);
+    signal(SIGUSR2, toggle_trace);
+
+    if ((infile = fopen(argv[arg], "rb")) == NULL) {
         perror("fopen");
         return 0;
     }
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "secd.h"
+
+/* Platform hooks for hosts with stdio, shared by the secd command and
+ * libsecd: values are read from stdin, written to stdout, and trace
+ * records go to stderr. */
+
+void print_cell(CELL *cell) {
+    int printed_first;
+    if (cell == NULL) return;
+
+    switch (cell->cell_type) {
+        case TYPE_INT:
+            printf("%d", (int) CELL_DATA(cell));
+            break;
+        case TYPE_NIL:
+            printf("NIL");
+            break;
+        case TYPE_CLOSURE:
+            printf("#<closure %d>", CLOSURE_ADDR(cell));
+            break;
+
+        case TYPE_CONS:
+            printf("(");
+            printed_first = 0;
+            while (cell != NULL) {
+                if (printed_first) printf(" ");
+                print_cell(cell_for_offset(CAR_OFFSET(cell)));
+                printed_first = 1;
+                cell = cell_for_offset(CDR_OFFSET(cell));
+                if ((cell == NULL) || (cell->cell_type == TYPE_NIL)) break;
+                if (cell->cell_type != TYPE_CONS) {
+                    printf(" . ");
+                    print_cell(cell);
+                    break;
+                }
+            }
+            printf(")");
+            break;
+
+        case TYPE_VECTOR:
+            printf("#(");
+            for (int i=0; i < VECTOR_LENGTH(cell); i++) {
+                if (i > 0) printf(" ");
+                if (VECTOR_KIND(cell) == VECTOR_INT) {
+                    printf("%d", VECTOR_SLOTS(cell)[i]);
+                } else {
+                    print_cell(cell_for_offset(VECTOR_SLOTS(cell)[i]));
+                }
+            }
+            printf(")");
+            break;
+
+        case TYPE_HASH:
+            printf("#hash(");
+            printed_first = 0;
+            for (int i=0; i < HASH_CAPACITY(cell); i++) {
+                int *entry = &HASH_ENTRIES(cell)[i*3];
+
+                if (entry[0] != HASH_FULL) continue;
+                if (printed_first) printf(" ");
+                printf("(%d . ", entry[1]);
+                print_cell(cell_for_offset(entry[2]));
+                printf(")");
+                printed_first = 1;
+            }
+            printf(")");
+            break;
+    }
+}
+
+int input_char() {
+    return getchar();
+}
+
+void unread_char(int ch) {
+    ungetc(ch, stdin);
+}
+
+void write_value(CELL *cell) {
+    print_cell(cell);
+    printf("\n");
+}
+
+/* Trace records go to stderr, one per line, for trace_decoder.scm */
+void write_trace_record(TRACE_RECORD *record) {
+    fprintf(stderr, "T %d %d %d %d %u\n", record->pc, record->opcode,
+            record->dump_depth, record->free_cells, record->alloc_count);
+}
@@ -12,9 +12,47 @@ extern "C" void mbed_reset();
 void panic(char *message)
 {
     pc.printf("%s\r\n", message);
+    dump_trace();
     NVIC_SystemReset();
 }
 
+void write_trace_record(TRACE_RECORD *record)
+{
+    pc.printf("T %d %d %d %d %u\r\n", record->pc, record->opcode,
+              record->dump_depth, record->free_cells, record->alloc_count);
+}
+
+int unread_ch;
+int has_unread = 0;
+
+/* Program input arrives on the serial port, ^D marks the end of it */
+int input_char()
+{
+    int ch;
+
+    if (has_unread) {
+        has_unread = 0;
+        return unread_ch;
+    }
+    ch = pc.getc();
+    if (ch == 4) {
+        return EOF;
+    }
+    return ch;
+}
+
+void unread_char(int ch)
+{
+    unread_ch = ch;
+    has_unread = 1;
+}
+
+void write_value(CELL *cell)
+{
+    print_cell(cell);
+    pc.printf("\r\n");
+}
+
 int main()
 {
     int ch, ch2, b, code_pos;
@@ -63,6 +101,11 @@ int main()
                 } else if ((ch == '\n') || (ch == '\r')) {
                     pc.printf("SECD Machine\r\n");
                     wait_for_colon = 0;
+                } else if (ch == 't') {
+                    trace_enabled = !trace_enabled;
+                    pc.printf("Trace %s\r\n", trace_enabled ? "on" : "off");
+                } else if (ch == 'd') {
+                    dump_trace();
                 } else {
                     pc.printf("Unexpected char - %c\r\n", ch);
                 }
@@ -0,0 +1,119 @@
+(use utils)
+(require-extension srfi-1)
+(require-extension srfi-13)
+
+;; Decodes the "T pc opcode depth free allocs" lines the VM dumps from its trace
+;; buffer, naming each pc by the ;FN= function of the assembly it came from.
+;; Usage: csi -s trace_decoder.scm program.gcc trace.txt
+
+(define opcodes '(("NIL" (0))
+		  ("LDC" (1 INT))
+		  ("LD"  (2 BYTE BYTE))
+		  ("ATOM" (3))
+		  ("CAR" (4))
+		  ("CDR" (5))
+		  ("CONS" (6))
+		  ("ADD" (7))
+		  ("SUB" (8))
+		  ("MUL" (9))
+		  ("DIV" (10))
+		  ("MOD" (11))
+		  ("SEL" (12 INT INT))
+		  ("JOIN" (13))
+		  ("LDF" (14 INT))
+		  ("AP" (15 BYTE))
+		  ("RTN" (16))
+		  ("DUM" (17 BYTE))
+		  ("RAP" (18 BYTE))
+		  ("STOP" (19))
+		  ("CGE" (20))
+		  ("CGT" (21))
+		  ("CEQ" (22))
+		  ("CNE" (23))
+		  ("CLE" (24))
+		  ("CLT" (25))
+		  ("TAP" (49 BYTE))
+		  ("TSEL" (26 INT INT))
+		  ("VMAKE" (27 BYTE))
+		  ("VREF" (28))
+		  ("VSET" (29))
+		  ("VLEN" (30))
+		  ("VFILL" (31))
+		  ("VCOPY" (32))
+		  ("READ" (33))
+		  ("WRITE" (34))
+		  ("EOFP" (35))
+		  ("HMAKE" (36))
+		  ("HGET" (37))
+		  ("HPUT" (38))
+		  ("HDEL" (39))
+		  ("HSIZE" (40))
+		  ("LDG" (41 INT))
+		  ("SPAWN" (42 BYTE))
+		  ("SEND" (43))
+		  ("RECV" (44))
+		  ("SELF" (45))
+		  ("CALLHOST" (46 BYTE BYTE))
+		  ("MEMO" (47))
+		  ("MRTN" (48))
+		  ))
+
+(define (comment? l)
+  (string-prefix? ";" l))
+
+(define (fn-comment? l)
+  (string-prefix? ";FN=" l))
+
+(define (instr-size parts)
+  (let ((args (cdr (cadr (assoc (car parts) opcodes)))))
+    (+ 1 (fold (lambda (a n) (+ n (if (equal? a 'INT) 4 1))) 0 args))))
+
+;; Returns (pc . name) for every function, in code order
+(define (function-starts lines)
+  (let loop ((lines lines) (pc 0) (fns '()))
+    (cond
+     [(null? lines) (reverse fns)]
+     [(fn-comment? (car lines))
+      (loop (cdr lines) pc (cons (cons pc (string-drop (car lines) 4)) fns))]
+     [(comment? (car lines)) (loop (cdr lines) pc fns)]
+     [else (loop (cdr lines) (+ pc (instr-size (string-split (car lines)))) fns)])))
+
+(define (function-for pc fns)
+  (let loop ((fns fns) (best #f))
+    (if (or (null? fns) (> (caar fns) pc))
+	best
+	(loop (cdr fns) (car fns)))))
+
+(define (opcode-name op)
+  (let ((entry (find (lambda (e) (= (car (cadr e)) op)) opcodes)))
+    (if entry (car entry) "?")))
+
+(define (decode-record parts fns)
+  (let* [(pc (string->number (list-ref parts 1)))
+	 (op (string->number (list-ref parts 2)))
+	 (fn (function-for pc fns))]
+    (display pc)
+    (display " ")
+    (if fn
+	(begin
+	  (display (cdr fn))
+	  (display "+")
+	  (display (- pc (car fn))))
+	(display "?"))
+    (display " ")
+    (display (opcode-name op))
+    (display " depth=")
+    (display (list-ref parts 3))
+    (display " free=")
+    (display (list-ref parts 4))
+    (display " allocs=")
+    (display (list-ref parts 5))
+    (newline)))
+
+(define (decode-trace asm-file trace-file)
+  (let ((fns (function-starts (string-split (read-all asm-file) "\n")))
+	(records (filter (lambda (l) (string-prefix? "T " l))
+			 (string-split (read-all trace-file) "\n"))))
+    (for-each (lambda (l) (decode-record (string-split l " \t\r") fns)) records)))
+
+(decode-trace (cadr (argv)) (caddr (argv)))